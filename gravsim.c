@@ -31,6 +31,25 @@
 #include <stdio.h>
 #include "gravsim.h"
 
+/*
+    Close encounters between bodies other than the dominant one are integrated separately,
+    in a time-regularized two-body frame.
+    ENCOUNTER_ETA is the default for sim->encounter_eta, the regularized step size
+    as a fraction of the pair's dynamical time.
+    The logarithmic-Hamiltonian leapfrog takes about 2*pi/eta steps per orbit.
+*/
+#define ENCOUNTER_ETA       0.002
+#define MAX_ENCOUNTER_STEPS 1000000
+
+typedef struct
+{
+    int     npairs;                             /* number of pairs in close encounter */
+    int     a[MAX_BODIES/2];                    /* first body index of each pair */
+    int     b[MAX_BODIES/2];                    /* second body index of each pair */
+    char    skip[MAX_BODIES][MAX_BODIES];       /* skip[i][j] = 1 (i<j) to omit the pair's mutual force */
+}
+encounter_t;
+
 
 const vector_t ZeroVector = { {0.0, 0.0, 0.0} };
 
@@ -97,15 +116,27 @@ double Dot(vector_t a, vector_t b)
 }
 
 
+vector_t Cross(vector_t a, vector_t b)
+{
+    vector_t c;
+    c.c[0] = a.c[1]*b.c[2] - a.c[2]*b.c[1];
+    c.c[1] = a.c[2]*b.c[0] - a.c[0]*b.c[2];
+    c.c[2] = a.c[0]*b.c[1] - a.c[1]*b.c[0];
+    return c;
+}
+
+
 void Accelerations(
     int nbodies,
     const body_t body[],
     const state_t state[],
-    vector_t acc[])
+    vector_t acc[],
+    double *potential,
+    const encounter_t *enc)
 {
     int i, j;
     vector_t rv;
-    double r2, r3;
+    double r, r2, f;
 
     for (i=0; i < nbodies; ++i)
         acc[i] = ZeroVector;
@@ -117,12 +148,22 @@ void Accelerations(
         {
             rv = Sub(state[i].pos, state[j].pos);
             r2 = Dot(rv, rv);
-            r3 = r2 * sqrt(r2);
+            r = sqrt(r2);
+
+            /* The pair's potential energy reuses the distance we already have. */
+            if (potential != NULL)
+                *potential -= body[i].gm * body[j].gm / r;
+
+            /* Pairs in close encounter get their mutual force from ResolveEncounters() instead. */
+            if (enc != NULL && enc->skip[i][j])
+                continue;
 
             /* acceleration = GM / r^2 */
             /* divide by r^3 to also convert rv into a unit vector. */
-            acc[i] = Sub(acc[i], Mul(body[j].gm/r3, rv));
-            acc[j] = Add(acc[j], Mul(body[i].gm/r3, rv));
+            /* One reciprocal serves both bodies, which is cheaper than two divisions. */
+            f = 1.0 / (r2 * r);
+            acc[i] = Sub(acc[i], Mul(body[j].gm*f, rv));
+            acc[j] = Add(acc[j], Mul(body[i].gm*f, rv));
         }
     }
 }
@@ -144,12 +185,32 @@ void MoveBody(const state_t *instate, state_t *outstate, vector_t acc, double dt
 }
 
 
-void MoveAllBodies(int nbodies, const state_t instates[], state_t outstates[], vector_t acc[], double dt)
+void MoveAllBodies(
+    int nbodies,
+    const body_t body[],
+    const state_t instates[],
+    state_t outstates[],
+    vector_t acc[],
+    double dt,
+    conserved_t *cons)
 {
     int b;
+    double gm;
 
     for (b=0; b < nbodies; ++b)
+    {
+        /* If requested, add this body's contribution to the conserved quantities before it moves. */
+        if (cons != NULL)
+        {
+            gm = body[b].gm;
+            cons->kinetic += (gm / 2.0) * Dot(instates[b].vel, instates[b].vel);
+            cons->angmom = Add(cons->angmom, Mul(gm, Cross(instates[b].pos, instates[b].vel)));
+            cons->moment = Add(cons->moment, Mul(gm, instates[b].pos));
+            cons->momentum = Add(cons->momentum, Mul(gm, instates[b].vel));
+            cons->gmtotal += gm;
+        }
         MoveBody(&instates[b], &outstates[b], acc[b], dt);
+    }
 }
 
 
@@ -184,15 +245,314 @@ double PosError(int nbodies, state_t state1[], state_t state2[])
 }
 
 
+conserved_t *MonitorBegin(sim_t *sim, conserved_t *cons)
+{
+    /*
+        If the simulation has a monitor that is due for a sample on this step,
+        zero out the accumulators and return them, so that the force pass
+        and the first movement pass can fill them in.
+        Otherwise return NULL, so those passes skip the extra work.
+    */
+    monitor_t *mon = sim->monitor;
+
+    if (mon == NULL || mon->interval < 1)
+        return NULL;
+
+    if ((mon->nsteps++ % mon->interval) != 0)
+        return NULL;
+
+    cons->kinetic = 0.0;
+    cons->potential = 0.0;
+    cons->angmom = ZeroVector;
+    cons->moment = ZeroVector;
+    cons->momentum = ZeroVector;
+    cons->gmtotal = 0.0;
+    return cons;
+}
+
+
+void MonitorEnd(sim_t *sim, const conserved_t *cons)
+{
+    monitor_t *mon = sim->monitor;
+    const conserved_t *ref;
+    double energy, ref_energy;
+    vector_t diff, expected;
+
+    if (cons == NULL)
+        return;
+
+    /* The quantities were sampled from the state at the beginning of the step. */
+    mon->tt = sim->tt;
+    if (mon->nsamples++ == 0)
+    {
+        mon->tt0 = sim->tt;
+        mon->ref = *cons;
+        mon->energy_drift = mon->angmom_drift = mon->bary_drift = 0.0;
+        return;
+    }
+
+    ref = &mon->ref;
+
+    energy = cons->kinetic + cons->potential;
+    ref_energy = ref->kinetic + ref->potential;
+    mon->energy_drift = fabs((energy - ref_energy) / ref_energy);
+
+    mon->angmom_drift = RelativeDiscrepancy(ref->angmom, cons->angmom);
+
+    /* With no external forces, the barycenter moves in a straight line at constant speed. */
+    expected = Mul(1.0 / ref->gmtotal, Add(ref->moment, Mul(sim->tt - mon->tt0, ref->momentum)));
+    diff = Sub(Mul(1.0 / cons->gmtotal, cons->moment), expected);
+    mon->bary_drift = sqrt(Dot(diff, diff));
+
+    if (mon->max_drift > 0.0 && (mon->energy_drift > mon->max_drift || mon->angmom_drift > mon->max_drift))
+        mon->failed = 1;
+
+    if (mon->max_bary_drift > 0.0 && mon->bary_drift > mon->max_bary_drift)
+        mon->failed = 1;
+}
+
+
+const encounter_t *FindEncounters(const sim_t *sim, double dt, encounter_t *enc)
+{
+    /*
+        Find pairs of bodies, neither of them the dominant body,
+        that are closer to each other than the fraction sim->encounter_hill
+        of the larger body's Hill radius at some time during the step.
+        Each body takes part in at most one encounter per step.
+        Returns 'enc' if any encounters were found, or NULL otherwise.
+    */
+    int i, j, k, d;
+    int paired[MAX_BODIES];
+    double dist, hill, v2, tc;
+    vector_t rv, vv;
+
+    enc->npairs = 0;
+    if (sim->encounter_hill <= 0.0)
+        return NULL;
+
+    d = 0;
+    for (i=0; i < sim->nbodies; ++i)
+    {
+        paired[i] = 0;
+        if (sim->body[i].gm > sim->body[d].gm)
+            d = i;
+    }
+
+    for (i=0; i+1 < sim->nbodies; ++i)
+    {
+        for (j=i+1; j < sim->nbodies; ++j)
+        {
+            enc->skip[i][j] = 0;
+            if (i == d || j == d || paired[i] || paired[j])
+                continue;
+
+            /* Hill radius = a * cbrt(m / 3M), using the current distance from the dominant body for a. */
+            k = (sim->body[i].gm >= sim->body[j].gm) ? i : j;
+            rv = Sub(sim->state[k].pos, sim->state[d].pos);
+            dist = sqrt(Dot(rv, rv));
+            hill = dist * cbrt(sim->body[k].gm / (3.0 * sim->body[d].gm));
+
+            /* Find the closest approach during the step, assuming straight-line relative motion, */
+            /* so that fast bodies cannot skip over the encounter zone in a single step. */
+            rv = Sub(sim->state[i].pos, sim->state[j].pos);
+            vv = Sub(sim->state[i].vel, sim->state[j].vel);
+            v2 = Dot(vv, vv);
+            tc = (v2 > 0.0) ? -Dot(rv, vv) / v2 : 0.0;
+            /* Clamp to the step, which runs from 0 to dt in either direction of time. */
+            if (dt >= 0.0)
+            {
+                if (tc < 0.0)
+                    tc = 0.0;
+                else if (tc > dt)
+                    tc = dt;
+            }
+            else
+            {
+                if (tc > 0.0)
+                    tc = 0.0;
+                else if (tc < dt)
+                    tc = dt;
+            }
+            rv = Add(rv, Mul(tc, vv));
+            dist = sqrt(Dot(rv, rv));
+            if (dist < sim->encounter_hill * hill)
+            {
+                enc->skip[i][j] = 1;
+                enc->a[enc->npairs] = i;
+                enc->b[enc->npairs] = j;
+                ++(enc->npairs);
+                paired[i] = paired[j] = 1;
+            }
+        }
+    }
+
+    return (enc->npairs > 0) ? enc : NULL;
+}
+
+
+void TwoBodyLeapfrog(double mu, vector_t f, double dt, vector_t *pos, vector_t *vel)
+{
+    /* One ordinary drift-kick-drift leapfrog step of r'' = -mu*r/|r|^3 + f. */
+    double r;
+    vector_t p;
+
+    p = Add(*pos, Mul(dt/2.0, *vel));
+    r = sqrt(Dot(p, p));
+    *vel = Add(*vel, Mul(dt, Sub(f, Mul(mu/(r*r*r), p))));
+    *pos = Add(p, Mul(dt/2.0, *vel));
+}
+
+
+int RegularizedTwoBody(double mu, vector_t f, double dt, double eta, vector_t *pos, vector_t *vel)
+{
+    /*
+        Integrate the relative motion r'' = -mu*r/|r|^3 + f of an encounter pair over time dt.
+        A negative dt integrates backward in time.
+
+        This is the logarithmic-Hamiltonian leapfrog of Mikkola & Tanikawa (1999).
+        Like Kustaanheimo-Stiefel regularization, it integrates in a fictitious time s,
+        where dt = (r/mu)*ds, so the real time step shrinks automatically as the bodies approach.
+        For an unperturbed pair it follows the exact Kepler orbit, with only a phase error,
+        however close the pericenter passage.
+
+        B is the binding energy -(v^2/2 - mu/r). The perturbation f changes it at the rate -v.f.
+        The kick updates B along with v, so that both half-drifts around a kick see the same T+B
+        and the step stays time-symmetric.
+
+        Returns 0 on success, or 1 if the integration needed more than MAX_ENCOUNTER_STEPS steps.
+    */
+    int n, nsub, error;
+    double t, h, r, T, B, Bnext, dt1, dt2, dtk, rem, steps;
+    vector_t p, v, a, vold;
+
+    error = 0;
+    r = sqrt(Dot(*pos, *pos));
+    B = mu/r - Dot(*vel, *vel)/2.0;
+
+    /* The fictitious step h carries the sign of dt, so every time increment below does too. */
+    h = eta * sqrt(mu * r);
+    if (dt < 0.0)
+        h = -h;
+    t = 0.0;
+
+    for (n=0; n < MAX_ENCOUNTER_STEPS; ++n)
+    {
+        /* drift */
+        /* T+B equals mu/r for an unperturbed pair; a strong perturbation can */
+        /* drive it to zero or below, so fall back on ordinary leapfrog steps. */
+        T = Dot(*vel, *vel) / 2.0;
+        if (T + B <= 0.0)
+            break;
+        dt1 = (h/2.0) / (T + B);
+        p = Add(*pos, Mul(dt1, *vel));
+
+        /* kick */
+        r = sqrt(Dot(p, p));
+        dtk = h * r / mu;
+        a = Sub(f, Mul(mu/(r*r*r), p));
+        vold = *vel;
+        v = Add(vold, Mul(dtk, a));
+        Bnext = B - dtk * Dot(Average(vold, v), f);
+
+        /* drift */
+        T = Dot(v, v) / 2.0;
+        if (T + Bnext <= 0.0)
+            break;
+        dt2 = (h/2.0) / (T + Bnext);
+
+        /* Stop before overshooting the end of the interval. */
+        if (fabs(t + dt1 + dt2) > fabs(dt))
+            break;
+
+        B = Bnext;
+        *pos = Add(p, Mul(dt2, v));
+        *vel = v;
+        t += dt1 + dt2;
+    }
+
+    if (n == MAX_ENCOUNTER_STEPS)
+        error = 1;
+
+    /* Finish the remaining fraction of a regularized step with ordinary leapfrog steps. */
+    rem = dt - t;
+    r = sqrt(Dot(*pos, *pos));
+    steps = ceil(fabs(rem) / (eta * sqrt(r*r*r / mu)));
+    if (steps > MAX_ENCOUNTER_STEPS)
+    {
+        steps = MAX_ENCOUNTER_STEPS;
+        error = 1;
+    }
+
+    nsub = (int)steps;
+    for (n=0; n < nsub; ++n)
+        TwoBodyLeapfrog(mu, f, rem / nsub, pos, vel);
+
+    return error;
+}
+
+
+void ResolveEncounters(
+    sim_t *sim,
+    double dt,
+    const encounter_t *enc,
+    state_t next_state[],
+    const vector_t curr_acc[],
+    const vector_t next_acc[])
+{
+    /*
+        The global step moved each encounter pair without its mutual force,
+        so its center of mass followed the external forces correctly.
+        Replace the pair's relative motion with a regularized two-body integration
+        that starts from the relative state at the beginning of the step.
+        The external accelerations enter as a tidal perturbation, averaged over the step.
+    */
+    int n, i, j;
+    double gi, gj, mu, eta;
+    vector_t pos, vel, f, cpos, cvel;
+
+    eta = (sim->encounter_eta > 0.0) ? sim->encounter_eta : ENCOUNTER_ETA;
+
+    for (n=0; n < enc->npairs; ++n)
+    {
+        i = enc->a[n];
+        j = enc->b[n];
+        gi = sim->body[i].gm;
+        gj = sim->body[j].gm;
+        mu = gi + gj;
+
+        pos = Sub(sim->state[i].pos, sim->state[j].pos);
+        vel = Sub(sim->state[i].vel, sim->state[j].vel);
+        f = Average(Sub(curr_acc[i], curr_acc[j]), Sub(next_acc[i], next_acc[j]));
+        if (RegularizedTwoBody(mu, f, dt, eta, &pos, &vel))
+        {
+            fprintf(stderr, "ResolveEncounters: %s-%s encounter at tt=%0.6lf needed more than %d steps.\n",
+                sim->body[i].name, sim->body[j].name, sim->tt, MAX_ENCOUNTER_STEPS);
+            sim->encounter_failed = 1;
+        }
+
+        cpos = Mul(1.0/mu, Add(Mul(gi, next_state[i].pos), Mul(gj, next_state[j].pos)));
+        cvel = Mul(1.0/mu, Add(Mul(gi, next_state[i].vel), Mul(gj, next_state[j].vel)));
+
+        next_state[i].pos = Add(cpos, Mul(gj/mu, pos));
+        next_state[i].vel = Add(cvel, Mul(gj/mu, vel));
+        next_state[j].pos = Sub(cpos, Mul(gi/mu, pos));
+        next_state[j].vel = Sub(cvel, Mul(gi/mu, vel));
+    }
+}
+
+
 void SimUpdate1(sim_t *sim, double dt)
 {
     vector_t acc[MAX_BODIES];
+    conserved_t cons;
+    conserved_t *sample = MonitorBegin(sim, &cons);
 
     /* Calculate the accelerations acting on the bodies at the current time. */
-    Accelerations(sim->nbodies, sim->body, sim->state, acc);
+    Accelerations(sim->nbodies, sim->body, sim->state, acc, sample ? &sample->potential : NULL, NULL);
 
     /* Naively assume that accerlation applies over the entire time increment. */
-    MoveAllBodies(sim->nbodies, sim->state, sim->state, acc, dt);
+    MoveAllBodies(sim->nbodies, sim->body, sim->state, sim->state, acc, dt, sample);
+    MonitorEnd(sim, sample);
     sim->tt += dt;
 }
 
@@ -205,20 +565,23 @@ void ApproximateMovement(
     state_t next_state[],
     vector_t curr_acc[],
     vector_t mean_acc[],
-    vector_t next_acc[])
+    vector_t next_acc[],
+    conserved_t *cons,
+    const encounter_t *enc)
 {
     int i, b;
 
     /* Calculate accelerations of each body at the current time. */
-    Accelerations(nbodies, body, curr_state, curr_acc);
+    /* If 'cons' is not NULL, also sample the conserved quantities of the current state. */
+    Accelerations(nbodies, body, curr_state, curr_acc, cons ? &cons->potential : NULL, enc);
 
     /* Move the bodies as if current accerlation applies over the whole interval [0, dt]. */
-    MoveAllBodies(nbodies, curr_state, next_state, curr_acc, dt);
+    MoveAllBodies(nbodies, body, curr_state, next_state, curr_acc, dt, cons);
 
     for (i = 0; i < 2; ++i)
     {
         /* Calculate accelerations of the estimated next location of the bodies. */
-        Accelerations(nbodies, body, next_state, next_acc);
+        Accelerations(nbodies, body, next_state, next_acc, NULL, enc);
 
         /* Take the average of the beginning and ending accelerations */
         /* as estimates for mean acceleration. */
@@ -226,7 +589,7 @@ void ApproximateMovement(
             mean_acc[b] = Average(curr_acc[b], next_acc[b]);
 
         /* Refine the estimate of where the bodies will be after dt. */
-        MoveAllBodies(nbodies, curr_state, next_state, mean_acc, dt);
+        MoveAllBodies(nbodies, body, curr_state, next_state, mean_acc, dt, NULL);
     }
 }
 
@@ -237,12 +600,17 @@ void SimUpdate2(sim_t *sim, double dt)
     vector_t curr_acc[MAX_BODIES];
     vector_t mean_acc[MAX_BODIES];
     vector_t next_acc[MAX_BODIES];
+    encounter_t enc;
+    conserved_t cons;
+    conserved_t *sample = MonitorBegin(sim, &cons);
 
     /* Find a time-reversible mean acceleration over the interval dt. */
-    ApproximateMovement(sim->nbodies, dt, sim->body, sim->state, next_state, curr_acc, mean_acc, next_acc);
+    ApproximateMovement(sim->nbodies, dt, sim->body, sim->state, next_state, curr_acc, mean_acc, next_acc, sample, FindEncounters(sim, dt, &enc));
 
     /* Update the current state of each body to be the final refined estimate. */
+    ResolveEncounters(sim, dt, &enc, next_state, curr_acc, next_acc);
     CopyStates(sim->nbodies, next_state, sim->state);
+    MonitorEnd(sim, sample);
     sim->tt += dt;
 }
 
@@ -257,12 +625,15 @@ void SimUpdate3(sim_t *sim, double dt)
     vector_t curr_acc[MAX_BODIES];
     vector_t middle_acc[MAX_BODIES];
     vector_t next_acc[MAX_BODIES];
+    encounter_t enc;
+    conserved_t cons;
+    conserved_t *sample = MonitorBegin(sim, &cons);
 
     /* Find a time-reversible mean acceleration over the interval dt. */
-    ApproximateMovement(sim->nbodies, dt, sim->body, sim->state, next_state, curr_acc, middle_acc, next_acc);
+    ApproximateMovement(sim->nbodies, dt, sim->body, sim->state, next_state, curr_acc, middle_acc, next_acc, sample, FindEncounters(sim, dt, &enc));
 
     /* Apply the mean acceleration for half the time (dt/2) to find middle state (position and velocity). */
-    MoveAllBodies(sim->nbodies, sim->state, middle_state, middle_acc, dt / 2.0);
+    MoveAllBodies(sim->nbodies, sim->body, sim->state, middle_state, middle_acc, dt / 2.0, NULL);
 
     p = 2.0 / dt;
     dt2 = dt * dt;
@@ -297,7 +668,9 @@ void SimUpdate3(sim_t *sim, double dt)
         }
     }
 
+    ResolveEncounters(sim, dt, &enc, next_state, curr_acc, next_acc);
     CopyStates(sim->nbodies, next_state, sim->state);
+    MonitorEnd(sim, sample);
     sim->tt += dt;
 }
 
@@ -340,10 +713,15 @@ void SimUpdate4(sim_t *sim, double dt)
     vector_t curr_acc[MAX_BODIES];
     vector_t middle_acc[MAX_BODIES];
     vector_t next_acc[MAX_BODIES];
+    encounter_t enc;
+    conserved_t cons;
+    conserved_t *sample = MonitorBegin(sim, &cons);
 
     /* Find a time-reversible mean acceleration over the interval dt. */
-    ApproximateMovement(sim->nbodies, dt, sim->body, sim->state, next_state, curr_acc, middle_acc, next_acc);
+    ApproximateMovement(sim->nbodies, dt, sim->body, sim->state, next_state, curr_acc, middle_acc, next_acc, sample, FindEncounters(sim, dt, &enc));
     RefineLinearAcceleration(sim->nbodies, dt, sim->state, curr_acc, next_state, next_acc);
+    ResolveEncounters(sim, dt, &enc, next_state, curr_acc, next_acc);
     CopyStates(sim->nbodies, next_state, sim->state);
+    MonitorEnd(sim, sample);
     sim->tt += dt;
 }
@@ -69,12 +69,58 @@ typedef struct
 body_t;
 
 
+/*
+    Conserved quantities of the system at one moment in time.
+    Masses are not known separately from G, so each quantity uses GM in place of mass.
+    This scales both energies by G and the other quantities by G,
+    which does not affect relative drift.
+*/
+typedef struct
+{
+    double   kinetic;       /* sum of (1/2)*GM*v^2 over all bodies */
+    double   potential;     /* sum of -GM1*GM2/r over all pairs of bodies */
+    vector_t angmom;        /* sum of GM*(r x v): angular momentum */
+    vector_t moment;        /* sum of GM*r: divide by gmtotal to get the barycenter */
+    vector_t momentum;      /* sum of GM*v: divide by gmtotal to get the barycenter velocity */
+    double   gmtotal;       /* sum of GM */
+}
+conserved_t;
+
+
+/*
+    Optional monitor of conserved quantities, for catching a diverging integration early.
+    The caller fills in 'interval', 'max_drift', and 'max_bary_drift', and zeroes the rest.
+    The first sample becomes the reference for all later samples.
+*/
+typedef struct
+{
+    int         interval;           /* sample once every this many steps; 0 disables the monitor */
+    double      max_drift;          /* fail if relative energy or angular momentum drift exceeds this (0 = never) */
+    double      max_bary_drift;     /* fail if the barycenter strays this far [au] from its linear path (0 = never) */
+
+    int         nsteps;             /* steps taken since the monitor was attached */
+    int         nsamples;           /* samples taken so far */
+    double      tt0;                /* time of the reference sample */
+    conserved_t ref;                /* reference sample */
+    double      tt;                 /* time of the latest sample */
+    double      energy_drift;       /* latest relative drift of total energy */
+    double      angmom_drift;       /* latest relative drift of angular momentum */
+    double      bary_drift;         /* latest barycenter drift [au] */
+    int         failed;             /* set to 1 when a drift limit is exceeded */
+}
+monitor_t;
+
+
 typedef struct
 {
     double   tt;                /* Terrestrial Time, relative to 1 January 2000 noon [days] */
     int      nbodies;
     body_t   body[MAX_BODIES];
     state_t  state[MAX_BODIES];
+    monitor_t *monitor;             /* conserved quantity monitor, or NULL for none */
+    double   encounter_hill;        /* close encounter distance as a fraction of the Hill radius; 0 disables */
+    double   encounter_eta;         /* close encounter step as a fraction of the pair's dynamical time; 0 = default */
+    int      encounter_failed;      /* set to 1 when a close encounter needed too many steps */
 }
 sim_t;
 
@@ -83,6 +129,7 @@ vector_t Sub(vector_t a, vector_t b);
 vector_t Add(vector_t a, vector_t b);
 vector_t Mul(double k, vector_t v);
 double Dot(vector_t a, vector_t b);
+vector_t Cross(vector_t a, vector_t b);
 
 double RelativeDiscrepancy(vector_t a, vector_t b);
 
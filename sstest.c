@@ -33,6 +33,8 @@
 #include <math.h>
 #include "gravsim.h"
 
+typedef void (*update_func_t) (sim_t *sim, double dt);
+
 
 static int AddBody(
     sim_t *sim,
@@ -68,6 +70,10 @@ static int InitSolarSystem(sim_t *sim)
 
     sim->nbodies = 0;
     sim->tt = 0.0;
+    sim->monitor = NULL;
+    sim->encounter_hill = 0.0;
+    sim->encounter_eta = 0.0;
+    sim->encounter_failed = 0;
 
     CHECK(AddBody(
         sim, "Sun", 0.2959122082855911e-03,
@@ -131,6 +137,10 @@ int InitFinalState(sim_t *sim)
 
     sim->nbodies = 0;
     sim->tt = 36000.0;
+    sim->monitor = NULL;
+    sim->encounter_hill = 0.0;
+    sim->encounter_eta = 0.0;
+    sim->encounter_failed = 0;
 
     CHECK(AddBody(
         sim, "Sun", 0.2959122082855911e-03,
@@ -188,6 +198,112 @@ fail:
 }
 
 
+/*
+    A test particle flies 0.001 AU past Saturn, on a circular orbit around the Sun,
+    reaching closest approach at tt=40.
+    The initial state was found by integrating backward from closest approach.
+*/
+#define FLYBY_DAYS                  80
+#define FLYBY_REF_SAMPLES_PER_DAY   40000
+#define FLYBY_ENCOUNTER_HILL        0.5
+#define FLYBY_TOLERANCE             1.0e-5      /* maximum particle position error [au] with encounter handling */
+
+static int InitFlyby(sim_t *sim, double encounter_hill)
+{
+    int error;
+
+    sim->nbodies = 0;
+    sim->tt = 0.0;
+    sim->monitor = NULL;
+    sim->encounter_hill = encounter_hill;
+    sim->encounter_eta = 0.0;
+    sim->encounter_failed = 0;
+
+    CHECK(AddBody(
+        sim, "Sun", 0.2959122082855911e-03,
+        -2.7143907385635672e-03, +6.3807309917194983e-05, +0.0000000000000000e+00,
+        -3.7491130773446917e-08, -1.5948890226180306e-06, +0.0000000000000000e+00));
+
+    CHECK(AddBody(
+        sim, "Saturn", 0.8459715185680659e-07,
+        +9.4946619356392894e+00, -2.2319146174471399e-01, +0.0000000000000000e+00,
+        +1.3114015135016124e-04, +5.5787591224369503e-03, +0.0000000000000000e+00));
+
+    CHECK(AddBody(
+        sim, "Particle", 0.0,
+        +9.3120726729953507e+00, -4.1927781238374734e-01, -1.4706520770329023e-01,
+        +4.6568792567888168e-03, +1.0370548942714934e-02, +3.5938866801849918e-03));
+
+    error = 0;
+fail:
+    return error;
+}
+
+
+static double FlybyError(const sim_t *sim, const sim_t *ref)
+{
+    vector_t diff = Sub(sim->state[2].pos, ref->state[2].pos);
+    return sqrt(Dot(diff, diff));
+}
+
+
+static int FlybyTest(int fn, update_func_t func, int samples_per_day)
+{
+    int error;
+    int n, nsteps;
+    double dt, plain_error, encounter_error, backward_error;
+    sim_t start, ref, plain, encounter, backward;
+
+    if (func == SimUpdate1)
+        FAIL("Function #%d does not support close encounters.\n", fn);
+
+    /* Integrate a reference solution with very small time steps and no encounter handling. */
+    CHECK(InitFlyby(&start, 0.0));
+    ref = start;
+    nsteps = FLYBY_DAYS * FLYBY_REF_SAMPLES_PER_DAY;
+    dt = (double)FLYBY_DAYS / nsteps;
+    for (n=0; n < nsteps; ++n)
+        SimUpdate3(&ref, dt);
+
+    /* Integrate with the requested function and time step, without and with encounter handling. */
+    /* Also integrate backward from the reference's final state, with encounter handling. */
+    plain = start;
+    encounter = start;
+    encounter.encounter_hill = FLYBY_ENCOUNTER_HILL;
+    backward = ref;
+    backward.encounter_hill = FLYBY_ENCOUNTER_HILL;
+    nsteps = FLYBY_DAYS * samples_per_day;
+    dt = (double)FLYBY_DAYS / nsteps;
+    for (n=0; n < nsteps; ++n)
+    {
+        func(&plain, dt);
+        func(&encounter, dt);
+        func(&backward, -dt);
+    }
+
+    plain_error = FlybyError(&plain, &ref);
+    encounter_error = FlybyError(&encounter, &ref);
+    backward_error = FlybyError(&backward, &start);
+    printf("\nFlyby function #%d  dt=%0.6lf days\n", fn, dt);
+    printf("without encounter handling: %le AU\n", plain_error);
+    printf("with encounter handling:    %le AU\n", encounter_error);
+    printf("backward with encounters:   %le AU\n", backward_error);
+
+    if (encounter.encounter_failed || backward.encounter_failed)
+        FAIL("Close encounter integration exceeded its step limit.\n");
+
+    if (encounter_error >= plain_error)
+        FAIL("Encounter handling did not improve the flyby.\n");
+
+    if (encounter_error > FLYBY_TOLERANCE || backward_error > FLYBY_TOLERANCE)
+        FAIL("Flyby error exceeds tolerance of %le AU.\n", FLYBY_TOLERANCE);
+
+    error = 0;
+fail:
+    return error;
+}
+
+
 void Compare(sim_t *sim, sim_t *goal)
 {
     int i;
@@ -212,16 +328,38 @@ void Compare(sim_t *sim, sim_t *goal)
 
 int main(int argc, const char *argv[])
 {
-    typedef void (*update_func_t) (sim_t *sim, double dt);
-
     int error  = 1;
     sim_t sim, goal;
+    monitor_t monitor;
     double dt;
-    int n, fn, samples_per_day, nsteps;
+    int n, fn, samples_per_day, nsteps, nsamples, flyby;
     update_func_t func;
 
-    if (argc != 3)
-        FAIL("USAGE: sstest func samples_per_day\n");
+    /* "sstest flyby func samples_per_day" runs the close encounter test instead. */
+    flyby = (argc > 1 && 0 == strcmp(argv[1], "flyby"));
+    if (flyby)
+    {
+        ++argv;
+        --argc;
+    }
+
+    if (argc < 3 || argc > 5 || (flyby && argc != 3))
+        FAIL("USAGE: sstest func samples_per_day [monitor_interval [max_drift]]\n"
+             "       sstest flyby func samples_per_day\n");
+
+    memset(&monitor, 0, sizeof(monitor));
+    if (argc > 3)
+    {
+        monitor.interval = atoi(argv[3]);
+        if (monitor.interval < 1)
+            FAIL("Invalid monitor interval: '%s'\n", argv[3]);
+    }
+    if (argc > 4)
+    {
+        monitor.max_drift = atof(argv[4]);
+        if (monitor.max_drift <= 0.0)
+            FAIL("Invalid maximum drift: '%s'\n", argv[4]);
+    }
 
     samples_per_day = atoi(argv[2]);
     if (samples_per_day < 1)
@@ -251,12 +389,32 @@ int main(int argc, const char *argv[])
         FAIL("Invalid function selector '%s'\n", argv[1]);
     }
 
+    if (flyby)
+    {
+        error = FlybyTest(fn, func, samples_per_day);
+        goto fail;
+    }
+
     CHECK(InitSolarSystem(&sim));
     CHECK(InitFinalState(&goal))    ;
     dt = (goal.tt - sim.tt) / nsteps;
     printf("\nFunction #%d  dt=%0.6lf days\n", fn, dt);
+    if (monitor.interval > 0)
+        sim.monitor = &monitor;
+
+    nsamples = 0;
     for (n=0; n < nsteps; ++n)
+    {
         func(&sim, dt);
+        if (monitor.nsamples > nsamples)
+        {
+            nsamples = monitor.nsamples;
+            printf("tt=%0.3lf  energy drift=%le  angmom drift=%le  barycenter drift=%le AU\n",
+                monitor.tt, monitor.energy_drift, monitor.angmom_drift, monitor.bary_drift);
+            if (monitor.failed)
+                FAIL("Conserved quantity drift exceeded limit at tt=%0.3lf; aborting.\n", monitor.tt);
+        }
+    }
 
     Compare(&sim, &goal);
 